@@ -32,6 +32,11 @@
 #include <linux/hid.h>
 #include <linux/module.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/suspend.h>
+#include <linux/sort.h>
+#include <linux/hrtimer.h>
 
 static __u8 mi_gamepad_rdesc[] = {
 0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
@@ -158,29 +163,254 @@ static __u8 mi_gamepad_rdesc[] = {
 // 247 bytes
 };
 
-static __u8 *mi_report_fixup(struct hid_device *hdev, __u8 *rdesc, unsigned int *rsize)
-{
-  struct hid_device *hid = hid_get_drvdata(hdev);
-  rdesc = mi_gamepad_rdesc;
-  *rsize = sizeof(mi_gamepad_rdesc);
-  return rdesc;
+static const unsigned int mi_gamepad_keymap[] = {
+  [0x01] = BTN_SOUTH,
+  [0x02] = BTN_EAST,
+  [0x04] = BTN_NORTH,
+  [0x05] = BTN_WEST,
+  [0x07] = BTN_TL,
+  [0x08] = BTN_TR,
+  [0x0b] = BTN_SELECT,
+  [0x0c] = BTN_START,
+  [0x10] = BTN_MODE,
+  [0x0e] = BTN_THUMBL,
+  [0x0f] = BTN_THUMBR,
+};
+
+/* AC Home sits outside the button page, keymap slot right after it */
+#define MI_KEY_HOME 0x10
+
+/*
+ * Keypad page bits. The arrows repeat the hat switch and are only reported
+ * with dpad_keys set, derived from the hat so both always agree.
+ */
+static const unsigned int mi_gamepad_keypadmap[] = {
+  [0x4f] = KEY_RIGHT,
+  [0x50] = KEY_LEFT,
+  [0x51] = KEY_DOWN,
+  [0x52] = KEY_UP,
+  [0xf1] = KEY_BACK,
+};
+
+/* ABS_X is 0, so absmap entries carry MI_MAPPED to tell them from holes */
+#define MI_MAPPED 0x8000
+#define MI_ABS(c) (MI_MAPPED | (c))
+
+static const unsigned int mi_gamepad_absmap[] = {
+  [0x30] = MI_ABS(ABS_X),
+  [0x31] = MI_ABS(ABS_Y),
+  [0x33] = MI_ABS(ABS_RX),
+  [0x34] = MI_ABS(ABS_RY),
+  [0x32] = MI_ABS(ABS_Z),
+  [0x35] = MI_ABS(ABS_RZ),
+  [0x39] = MI_ABS(ABS_HAT0X),
+  [0x40] = MI_ABS(ABS_TILT_X),
+  [0x41] = MI_ABS(ABS_TILT_Y),
+};
+
+#define MI_USAGE_HAT  (HID_GD_HATSWITCH & HID_USAGE)
+#define MI_USAGE_HOME 0x000c0223
+
+/* Hat switch nibble, 0..7 clockwise from north, anything else is null */
+static const struct {
+  __s8 x, y;
+} mi_hat_dir[16] = {
+  { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 },
+  { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 },
+};
+
+/*
+ * Rumble is a feature report carrying one byte per motor. interval is
+ * the value index plus one of a report interval (in ms) in the same
+ * report. Only set it for a layout known to be honoured by the firmware,
+ * every rumble report carries it.
+ */
+struct mi_ff_format {
+  __u8 report_id;
+  __u8 count;
+  __u8 weak;
+  __u8 strong;
+  __u8 interval;
+};
+
+/*
+ * Input report layout is not part of the profile: it is read from the
+ * parsed descriptor at probe time, see mi_build_plan().
+ */
+struct mi_profile {
+  const char *name;
+  __u16 bus;
+  __u32 vendor, product, version;
+  __u8 *rdesc;
+  unsigned int rsize;
+  __u8 report_id;
+  const unsigned int *keymap;
+  unsigned int nkeys;
+  const unsigned int *keypadmap;
+  unsigned int nkeypad;
+  const unsigned int *absmap;
+  unsigned int nabs;
+  __u64 invert;  /* BIT_ULL(ABS_*) of axes reported upside down */
+  __u64 rest_min;  /* BIT_ULL(ABS_*) of axes resting at their minimum */
+  struct mi_ff_format ff;
+};
+
+static const struct mi_profile mi_gamepad_profile = {
+  .name     = "Microsoft X-Box 360 pad",
+  .bus      = BUS_USB,
+  .vendor   = 0x045e,
+  .product  = 0x028e,
+  .version  = 0x0110,
+  .rdesc    = mi_gamepad_rdesc,
+  .rsize    = sizeof(mi_gamepad_rdesc),
+  .report_id = 0x04,
+  .keymap   = mi_gamepad_keymap,
+  .nkeys    = ARRAY_SIZE(mi_gamepad_keymap),
+  .keypadmap = mi_gamepad_keypadmap,
+  .nkeypad  = ARRAY_SIZE(mi_gamepad_keypadmap),
+  .absmap   = mi_gamepad_absmap,
+  .nabs     = ARRAY_SIZE(mi_gamepad_absmap),
+  .invert   = BIT_ULL(ABS_TILT_X),
+  .rest_min = BIT_ULL(ABS_Z) | BIT_ULL(ABS_RZ),
+  .ff       = { .report_id = 0x20, .count = 6, .weak = 0, .strong = 1 },
+};
+
+/*
+ * Decode plan: one op per run of report fields, sorted by bit offset.
+ * Key bits sharing a byte and consecutive byte-sized axes are merged
+ * into a single op.
+ */
+#define MI_OP_MERGE 8
+
+enum {
+  MI_OP_KEYS,   /* up to 8 bits of one byte, code[bit] */
+  MI_OP_ABS8,   /* consecutive unsigned bytes */
+  MI_OP_ABS16,  /* byte aligned 16-bit little endian */
+  MI_OP_ABS,    /* anything else, through hid_field_extract() */
+  MI_OP_HAT,    /* 4-bit hat switch to code, code + 1 */
+};
+
+#define MI_OPF_SIGNED BIT(0)
+#define MI_OPF_INVERT BIT(1)
+
+struct mi_op {
+  __u16 offset;  /* in bits, past the report ID */
+  __u8 size;
+  __u8 count;
+  __u8 kind;
+  __u8 flags;
+  __u16 code[MI_OP_MERGE];
+};
+
+static unsigned int reconnect_cache_secs = 30;
+module_param(reconnect_cache_secs, uint, 0644);
+MODULE_PARM_DESC(reconnect_cache_secs, "Seconds a dropped pad's state is kept for reconnect (0 = off)");
+
+static bool dpad_keys;
+module_param(dpad_keys, bool, 0444);
+MODULE_PARM_DESC(dpad_keys, "Also report the d-pad as KEY_UP/DOWN/LEFT/RIGHT (default: hat axes only)");
+
+static unsigned int stall_factor;
+module_param(stall_factor, uint, 0644);
+MODULE_PARM_DESC(stall_factor, "Release inputs after this many missed report intervals (0 = off)");
+
+static unsigned int idle_rumble_secs = 5;
+module_param(idle_rumble_secs, uint, 0644);
+MODULE_PARM_DESC(idle_rumble_secs, "Seconds without an input consumer before rumble is turned off");
+
+#define MI_MAX_PADS 8
+#define MI_FF_EFFECTS 16  /* ff-memless effect slots */
+#define MI_MAX_GROUPS 4
+
+/* Per-pad state that survives a Bluetooth drop */
+struct mi_pad_state {
+  int slot;
+  unsigned int reconnects;
+  unsigned int group;
+  unsigned int interval_ms;
+  unsigned int stall_factor;
 };
 
 struct miff_device {
+  const struct mi_profile *profile;
+  struct input_dev *input;
+  struct mi_pad_state state;
+  ktime_t dropped, probed, first_input;
+  const struct mi_op *plan;
+  unsigned int nplan, plan_size;
   struct hid_report *report;
+  struct mutex ff_lock;
   struct work_struct state_worker;
+  struct delayed_work idle_worker;
+  struct work_struct stall_worker;
+  struct hrtimer stall_timer;
+  spinlock_t input_lock;
+  ktime_t last_report;
+  s64 interval_ns;
+  unsigned int stalls;
+  bool stalled;
+  struct notifier_block pm_notifier;
   struct hid_device *hdev;
+  struct list_head group_node;
+  s64 group_skew_ns;
   int left, right;
+  DECLARE_BITMAP(ff_playing, MI_FF_EFFECTS);
+  int ff_count[MI_FF_EFFECTS];
+  unsigned long ff_until[MI_FF_EFFECTS];  /* 0 if the effect has no end */
+  bool dpad_keys;
+  bool suspended;
   __u8 worker_initialized;
 };
 
+static __u8 *mi_report_fixup(struct hid_device *hdev, __u8 *rdesc, unsigned int *rsize)
+{
+  struct miff_device *miff = hid_get_drvdata(hdev);
+  rdesc = miff->profile->rdesc;
+  *rsize = miff->profile->rsize;
+  return rdesc;
+};
+
+static void miff_send(struct miff_device *miff, int left, int right)
+{
+  const struct mi_ff_format *ff = &miff->profile->ff;
+  struct input_dev *input = READ_ONCE(miff->input);
+
+  if (!miff->report)
+    return;
+
+  /* Nobody has the pad open to stop it, e.g. group_rumble without a length */
+  if ((left || right) && input && !input->users &&
+      !READ_ONCE(miff->suspended))
+    schedule_delayed_work(&miff->idle_worker, idle_rumble_secs * HZ);
+
+  mutex_lock(&miff->ff_lock);
+  miff->report->field[0]->value[ff->weak] = left;
+  miff->report->field[0]->value[ff->strong] = right;
+  if (ff->interval)
+    miff->report->field[0]->value[ff->interval - 1] = miff->state.interval_ms;
+  hid_hw_request(miff->hdev, miff->report, HID_REQ_SET_REPORT);
+  mutex_unlock(&miff->ff_lock);
+}
+
 static void miff_state_worker(struct work_struct *work)
 {
   struct miff_device *miff = container_of(work, struct miff_device, state_worker);
 
-  miff->report->field[0]->value[0] = miff->left;
-  miff->report->field[0]->value[1] = miff->right;
-  hid_hw_request(miff->hdev, miff->report, HID_REQ_SET_REPORT);
+  miff_send(miff, miff->left, miff->right);
+}
+
+/* Nobody has the pad open any more, don't leave the motors running */
+static void miff_idle_worker(struct work_struct *work)
+{
+  struct miff_device *miff = container_of(to_delayed_work(work),
+                                          struct miff_device, idle_worker);
+
+  if (!miff->left && !miff->right)
+    return;
+
+  hid_dbg(miff->hdev, "idle, stopping rumble\n");
+  miff->left = miff->right = 0;
+  miff_send(miff, 0, 0);
 }
 
 static int miff_play(struct input_dev *dev, void *data,
@@ -189,7 +419,7 @@ static int miff_play(struct input_dev *dev, void *data,
   struct hid_device *hid = input_get_drvdata(dev);
   struct miff_device *miff = hid_get_drvdata(hid);
 
-  if (effect->type != FF_RUMBLE)
+  if (effect->type != FF_RUMBLE || READ_ONCE(miff->suspended))
       return 0;
   miff->left = effect->u.rumble.weak_magnitude / 256;
   miff->right = effect->u.rumble.strong_magnitude / 256;
@@ -198,188 +428,1144 @@ static int miff_play(struct input_dev *dev, void *data,
   return 0;
 };
 
-static int mi_init_ff(struct miff_device *miff)
+static void miff_track(struct miff_device *miff, struct input_dev *dev,
+                       unsigned int id, int count)
+{
+  const struct ff_replay *replay = &dev->ff->effects[id].replay;
+
+  __set_bit(id, miff->ff_playing);
+  miff->ff_count[id] = count;
+  miff->ff_until[id] = replay->length ? jiffies +
+      msecs_to_jiffies((replay->delay + replay->length) * count) : 0;
+}
+
+/*
+ * Sits in front of input_ff_event() to know which effects userspace has
+ * started, so they can be stopped on suspend and restarted on resume.
+ * Called with dev->event_lock held.
+ */
+static int miff_event(struct input_dev *dev, unsigned int type,
+                      unsigned int code, int value)
 {
-  struct hid_input *hidinput = list_entry(miff->hdev->inputs.next,
-                                          struct hid_input, list);
-  struct input_dev *dev = hidinput->input;
+  struct miff_device *miff = hid_get_drvdata(input_get_drvdata(dev));
+
+  if (type == EV_FF && code < MI_FF_EFFECTS && code < dev->ff->max_effects) {
+    if (value > 0)
+      miff_track(miff, dev, code, value);
+    else
+      __clear_bit(code, miff->ff_playing);
+  }
+
+  return input_ff_event(dev, type, code, value);
+}
+
+/*
+ * ff-core stops an effect through ff->playback on erase, which
+ * miff_event() never sees; drop it here so a later upload into the same
+ * slot isn't restarted by miff_ff_resume().
+ */
+static int miff_ff_erase(struct input_dev *dev, int effect_id)
+{
+  struct miff_device *miff = hid_get_drvdata(input_get_drvdata(dev));
+
+  if (effect_id < MI_FF_EFFECTS) {
+    spin_lock_irq(&dev->event_lock);
+    __clear_bit(effect_id, miff->ff_playing);
+    spin_unlock_irq(&dev->event_lock);
+  }
+  return 0;
+}
 
-  miff->report = hid_validate_values(miff->hdev, HID_FEATURE_REPORT, 0, 0, 6);
+static int mi_init_ff(struct miff_device *miff, struct input_dev *dev)
+{
+  const struct mi_ff_format *ff = &miff->profile->ff;
+  int error;
+
+  miff->report = hid_validate_values(miff->hdev, HID_FEATURE_REPORT,
+                                     ff->report_id, 0, ff->count);
   if (!miff->report)
     return -ENODEV;
 
   input_set_capability(dev, EV_FF, FF_RUMBLE);
-  return input_ff_create_memless(dev, NULL, miff_play);
+  error = input_ff_create_memless(dev, NULL, miff_play);
+  if (error)
+    return error;
+
+  dev->ff->erase = miff_ff_erase;
+  dev->event = miff_event;
+  return 0;
 }
 
-static const unsigned int mi_gamepad_keymap[] = {
-  [0x01] = BTN_SOUTH,
-  [0x02] = BTN_EAST,
-  [0x04] = BTN_NORTH,
-  [0x05] = BTN_WEST,
-  [0x07] = BTN_TL,
-  [0x08] = BTN_TR,
-  [0x0b] = BTN_SELECT,
-  [0x0c] = BTN_START,
-  [0x10] = BTN_MODE,
-  [0x0e] = BTN_THUMBL,
-  [0x0f] = BTN_THUMBR,
-};
+/* The pad only streams while someone has the input device open */
+static int mi_input_open(struct input_dev *dev)
+{
+  struct hid_device *hdev = input_get_drvdata(dev);
+  struct miff_device *miff = hid_get_drvdata(hdev);
 
-static const unsigned int mi_gamepad_absmap[] = {
-  [0x30] = ABS_X,
-  [0x31] = ABS_Y,
-  [0x33] = ABS_RX,
-  [0x34] = ABS_RY,
-  [0x32] = ABS_Z,
-  [0x35] = ABS_RZ,
-  [0x39] = ABS_HAT0X,
-};
+  cancel_delayed_work_sync(&miff->idle_worker);
+  miff->last_report = 0;
+  return hid_hw_open(hdev);
+}
 
-#define map_abs_clear(c)	hid_map_usage_clear(hi, usage, bit, \
-		max, EV_ABS, (c))
-#define map_key_clear(c)	hid_map_usage_clear(hi, usage, bit, \
-		max, EV_KEY, (c))
-
-static int mi_mapped(struct hid_device *hdev, struct hid_input *hi,
-                           struct hid_field *field, struct hid_usage *usage,
-                           unsigned long **bit, int *max)
-{
-  unsigned int key = usage->hid & HID_USAGE;
-//hid_info(hdev, "can't alloc sony descriptor %x\n", key);
-  switch (key) {
-  case 0x0223: map_key_clear(BTN_MODE); break;
-  case 0x9: return -1; break;
-  case 0xa: return -1; break;
-  case 0x3: return -1; break;
-  case 0x6: return -1; break;
-  case 0x36: return -1; break;
-  case 0x37: return -1; break;
-  case 0x3b: return -1; break;
-  case 0x40: map_abs_clear(ABS_TILT_X); break;
-  case 0x41: map_abs_clear(ABS_TILT_Y); break;
-  case 0x42: return -1; break;
-  default:
-    return 0;
+static void mi_input_close(struct input_dev *dev)
+{
+  struct hid_device *hdev = input_get_drvdata(dev);
+  struct miff_device *miff = hid_get_drvdata(hdev);
+  unsigned long flags;
+
+  hid_hw_close(hdev);
+  /*
+   * No reports are expected now, don't call that a stall. users is
+   * already 0, so once a report in flight drops input_lock nothing
+   * re-arms the timer.
+   */
+  spin_lock_irqsave(&miff->input_lock, flags);
+  spin_unlock_irqrestore(&miff->input_lock, flags);
+  hrtimer_cancel(&miff->stall_timer);
+
+  if (!READ_ONCE(miff->suspended))
+    schedule_delayed_work(&miff->idle_worker, idle_rumble_secs * HZ);
+}
+
+/* Key tables use 0 (KEY_RESERVED) for holes, the abs table MI_MAPPED */
+static bool mi_map_usage(const struct mi_profile *profile, unsigned int hid,
+                         unsigned int *type, unsigned int *code)
+{
+  unsigned int usage = hid & HID_USAGE;
+
+  *code = 0;
+  if (hid == MI_USAGE_HOME) {
+    *type = EV_KEY;
+    *code = profile->keymap[MI_KEY_HOME];
+    return *code != 0;
   }
-  return 0;
+
+  switch (hid & HID_USAGE_PAGE) {
+  case HID_UP_BUTTON:
+    *type = EV_KEY;
+    if (usage < profile->nkeys)
+      *code = profile->keymap[usage];
+    return *code != 0;
+  case HID_UP_KEYBOARD:
+    *type = EV_KEY;
+    if (usage < profile->nkeypad)
+      *code = profile->keypadmap[usage];
+    return *code != 0;
+  case HID_UP_GENDESK:
+    *type = EV_ABS;
+    if (usage >= profile->nabs || !(profile->absmap[usage] & MI_MAPPED))
+      return false;
+    *code = profile->absmap[usage] & ~MI_MAPPED;
+    return true;
+  }
+
+  return false;
+}
+
+static bool mi_is_arrow(unsigned int code)
+{
+  return code == KEY_UP || code == KEY_DOWN ||
+         code == KEY_LEFT || code == KEY_RIGHT;
+}
+
+static int mi_op_cmp(const void *a, const void *b)
+{
+  const struct mi_op *x = a, *y = b;
+
+  if (x->offset != y->offset)
+    return (int)x->offset - (int)y->offset;
+  return (int)x->kind - (int)y->kind;
 }
+
+static bool mi_op_merge(struct mi_op *last, const struct mi_op *op)
+{
+  unsigned int bit;
+
+  if (last->kind != op->kind || last->flags != op->flags)
+    return false;
+
+  switch (op->kind) {
+  case MI_OP_KEYS:
+    if (last->offset != op->offset)
+      return false;
+    for (bit = 0; bit < op->count; bit++)
+      if (op->code[bit])
+        last->code[bit] = op->code[bit];
+    last->count = max(last->count, op->count);
+    return true;
+  case MI_OP_ABS8:
+    if (op->offset != last->offset + 8 * last->count ||
+        last->count == MI_OP_MERGE)
+      return false;
+    last->code[last->count++] = op->code[0];
+    return true;
+  }
+
+  return false;
+}
+
 /*
-static int mi_mapping(struct hid_device *hdev, struct hid_input *hi,
-                        struct hid_field *field, struct hid_usage *usage,
-                        unsigned long **bit, int *max)
-{
-  unsigned int key = usage->hid & HID_USAGE;
-hid_info(hdev, "can't alloc sony descriptor %x\n", key);
-  switch (usage->hid & HID_USAGE_PAGE) {
-  case HID_UP_BUTTON: {
-    key = mi_gamepad_keymap[key];
-    if (!key)
-      return -1;
-    hid_map_usage_clear(hi, usage, bit, max, EV_KEY, key);
-    break;
+ * Walk the parsed input report once and turn every mapped field into a
+ * decode op, setting the input capabilities on the way.
+ */
+static int mi_build_plan(struct miff_device *miff, struct input_dev *dev)
+{
+  const struct mi_profile *profile = miff->profile;
+  struct hid_report_enum *re = &miff->hdev->report_enum[HID_INPUT_REPORT];
+  struct hid_report *report = re->report_id_hash[profile->report_id];
+  struct mi_op *plan, *op;
+  unsigned int i, j, n = 0, type, code;
+
+  if (!report)
+    return -ENODEV;
+
+  for (i = 0; i < report->maxfield; i++)
+    n += report->field[i]->report_count;
+
+  plan = devm_kcalloc(&miff->hdev->dev, n ?: 1, sizeof(*plan), GFP_KERNEL);
+  if (!plan)
+    return -ENOMEM;
+
+  n = 0;
+  for (i = 0; i < report->maxfield; i++) {
+    struct hid_field *field = report->field[i];
+    int lmin = field->logical_minimum, lmax = field->logical_maximum;
+
+    if (!(field->flags & HID_MAIN_ITEM_VARIABLE))
+      continue;
+
+    for (j = 0; j < field->report_count && j < field->maxusage; j++) {
+      unsigned int offset = field->report_offset + j * field->report_size;
+      unsigned int size = field->report_size;
+
+      if (!mi_map_usage(profile, field->usage[j].hid, &type, &code))
+        continue;
+
+      op = &plan[n];
+      memset(op, 0, sizeof(*op));
+      op->size = size;
+      op->count = 1;
+      op->code[0] = code;
+
+      if (type == EV_KEY) {
+        if (size != 1 || mi_is_arrow(code))
+          continue;
+        op->kind = MI_OP_KEYS;
+        op->offset = offset & ~7;
+        op->count = (offset & 7) + 1;
+        op->code[0] = 0;
+        op->code[offset & 7] = code;
+        input_set_capability(dev, EV_KEY, code);
+        n++;
+        continue;
+      }
+
+      op->offset = offset;
+      if ((field->usage[j].hid & HID_USAGE) == MI_USAGE_HAT) {
+        if (size > 4)
+          continue;
+        op->kind = MI_OP_HAT;
+        input_set_abs_params(dev, code, -1, 1, 0, 0);
+        input_set_abs_params(dev, code + 1, -1, 1, 0, 0);
+        n++;
+        continue;
+      }
+
+      if (lmin < 0)
+        op->flags |= MI_OPF_SIGNED;
+      if (code < 64 && (profile->invert & BIT_ULL(code))) {
+        op->flags |= MI_OPF_INVERT;
+        swap(lmin, lmax);
+        lmin = -lmin;
+        lmax = -lmax;
+      }
+
+      if (!(offset & 7) && size == 8 && !op->flags)
+        op->kind = MI_OP_ABS8;
+      else if (!(offset & 7) && size == 16)
+        op->kind = MI_OP_ABS16;
+      else
+        op->kind = MI_OP_ABS;
+
+      input_set_abs_params(dev, code, lmin, lmax,
+                           (lmax - lmin) >> 8, (lmax - lmin) >> 4);
+      n++;
+    }
   }
-  case HID_UP_GENDESK: {
-    key = mi_gamepad_absmap[key];
-    if (!key)
-      return -1;
-    hid_map_usage_clear(hi, usage, bit, max, EV_ABS, key);
-    break;
+
+  if (miff->dpad_keys) {
+    input_set_capability(dev, EV_KEY, KEY_UP);
+    input_set_capability(dev, EV_KEY, KEY_DOWN);
+    input_set_capability(dev, EV_KEY, KEY_LEFT);
+    input_set_capability(dev, EV_KEY, KEY_RIGHT);
   }
-  default:
-    return -1;
+
+  sort(plan, n, sizeof(*plan), mi_op_cmp, NULL);
+
+  for (i = 0, j = 0; i < n; i++) {
+    if (j && mi_op_merge(&plan[j - 1], &plan[i]))
+      continue;
+    if (i != j)
+      plan[j] = plan[i];
+    j++;
+  }
+
+  miff->plan = plan;
+  miff->nplan = j;
+  miff->plan_size = hid_report_len(report);
+  hid_dbg(miff->hdev, "decode plan: %u fields in %u ops\n", n, j);
+  return 0;
+}
+
+static int mi_init_input(struct miff_device *miff)
+{
+  struct hid_device *hdev = miff->hdev;
+  struct input_dev *dev;
+  int error;
+
+  dev = input_allocate_device();
+  if (!dev)
+    return -ENOMEM;
+
+  dev->name = hdev->name;
+  dev->phys = hdev->phys;
+  dev->uniq = hdev->uniq;
+  dev->id.bustype = hdev->bus;
+  dev->id.vendor = hdev->vendor;
+  dev->id.product = hdev->product;
+  dev->id.version = hdev->version;
+  dev->dev.parent = &hdev->dev;
+  dev->open = mi_input_open;
+  dev->close = mi_input_close;
+  input_set_drvdata(dev, hdev);
+
+  error = mi_build_plan(miff, dev);
+  if (error) {
+    hid_err(hdev, "no usable input report %u\n", miff->profile->report_id);
+    goto err_free;
   }
 
-  return 1;
+  error = mi_init_ff(miff, dev);
+  if (error)
+    hid_warn(hdev, "no rumble support\n");
+
+  error = input_register_device(dev);
+  if (error)
+    goto err_free;
+
+  miff->input = dev;
+  return 0;
+
+err_free:
+  input_free_device(dev);
+  return error;
 }
-*/
+
 /*
-static int mi_event(struct hid_device *hdev, struct hid_field *field,
-                    struct hid_usage *usage, __s32 value)
+ * Must run before hid_hw_stop(): unregistering closes the device, which
+ * still calls hid_hw_close(). A report already past the checks in
+ * mi_raw_event() sees the NULL under input_lock.
+ */
+static void mi_remove_input(struct miff_device *miff)
 {
-  switch (usage->code) {
-    case KEY_HOMEPAGE: {
-      input_event(field->hidinput->input, usage->type, BTN_MODE, value);
-      return 1;
-    }
-    case BTN_TL2:
-      return 1;
-    case BTN_TR2:
-      return 1;
-    case ABS_BRAKE: {
-      input_event(field->hidinput->input, usage->type, ABS_Z, value);
-      return 1;
-    }
-    case ABS_THROTTLE: {
-      input_event(field->hidinput->input, usage->type, ABS_RZ, value);
-      return 1;
-    }
-    case ABS_Z: {
-      input_event(field->hidinput->input, usage->type, ABS_RX, value);
-      return 1;
-    }
-    case ABS_RZ: {
-      input_event(field->hidinput->input, usage->type, ABS_RY, value);
-      return 1;
-    }
-    case ABS_MISC: {
-      input_event(field->hidinput->input, usage->type, ABS_TILT_X, -value+150);
-      return 1;
-    }
-    case 0x29: {
-      input_event(field->hidinput->input, usage->type, ABS_TILT_Y, value);
-      return 1;
-    }
+  struct input_dev *dev = miff->input;
+  unsigned long flags;
+
+  if (!dev)
+    return;
+
+  spin_lock_irqsave(&miff->input_lock, flags);
+  miff->input = NULL;
+  spin_unlock_irqrestore(&miff->input_lock, flags);
+  input_unregister_device(dev);
+}
 
-    case 0x2A: {
-      input_event(field->hidinput->input, usage->type, ABS_TILT_Y, value);
-      return 1;
+/* data points past the report ID */
+static void mi_decode(struct miff_device *miff, __u8 *data)
+{
+  struct input_dev *dev = miff->input;
+  const struct mi_op *op, *end = miff->plan + miff->nplan;
+  unsigned int i, hat;
+  int value;
+
+  for (op = miff->plan; op < end; op++) {
+    const __u8 *p = data + (op->offset >> 3);
+
+    switch (op->kind) {
+    case MI_OP_KEYS:
+      for (i = 0; i < op->count; i++)
+        if (op->code[i])
+          input_report_key(dev, op->code[i], *p & BIT(i));
+      continue;
+    case MI_OP_ABS8:
+      for (i = 0; i < op->count; i++)
+        input_report_abs(dev, op->code[i], p[i]);
+      continue;
+    case MI_OP_HAT:
+      hat = hid_field_extract(miff->hdev, data, op->offset, op->size);
+      input_report_abs(dev, op->code[0], mi_hat_dir[hat].x);
+      input_report_abs(dev, op->code[0] + 1, mi_hat_dir[hat].y);
+      if (miff->dpad_keys) {
+        input_report_key(dev, KEY_UP, mi_hat_dir[hat].y < 0);
+        input_report_key(dev, KEY_DOWN, mi_hat_dir[hat].y > 0);
+        input_report_key(dev, KEY_LEFT, mi_hat_dir[hat].x < 0);
+        input_report_key(dev, KEY_RIGHT, mi_hat_dir[hat].x > 0);
+      }
+      continue;
+    case MI_OP_ABS16:
+      value = p[0] | p[1] << 8;
+      if (op->flags & MI_OPF_SIGNED)
+        value = (__s16)value;
+      break;
+    default:
+      value = hid_field_extract(miff->hdev, data, op->offset, op->size);
+      if (op->flags & MI_OPF_SIGNED)
+        value = sign_extend32(value, op->size - 1);
+      break;
     }
-    break;
+
+    if (op->flags & MI_OPF_INVERT)
+      value = -value;
+    input_report_abs(dev, op->code[0], value);
   }
 
-  return 0;
-}*/
+  input_sync(dev);
+}
 
-static int mi_event(struct hid_device *hdev, struct hid_field *field,
-                    struct hid_usage *usage, __s32 value)
+/* Let go of everything the pad last reported as held or deflected */
+static void mi_release_inputs(struct miff_device *miff)
 {
-  switch (usage->code) {
-    case ABS_TILT_X: {
-      input_event(field->hidinput->input, usage->type, ABS_TILT_X, -value);
-      return 1;
+  const struct mi_profile *profile = miff->profile;
+  struct input_dev *dev = miff->input;
+  const struct mi_op *op, *end = miff->plan + miff->nplan;
+  unsigned int i, code;
+  int value;
+
+  for (op = miff->plan; op < end; op++) {
+    switch (op->kind) {
+    case MI_OP_KEYS:
+      for (i = 0; i < op->count; i++)
+        if (op->code[i])
+          input_report_key(dev, op->code[i], 0);
+      break;
+    case MI_OP_HAT:
+      input_report_abs(dev, op->code[0], 0);
+      input_report_abs(dev, op->code[0] + 1, 0);
+      if (miff->dpad_keys) {
+        input_report_key(dev, KEY_UP, 0);
+        input_report_key(dev, KEY_DOWN, 0);
+        input_report_key(dev, KEY_LEFT, 0);
+        input_report_key(dev, KEY_RIGHT, 0);
+      }
+      break;
+    default:
+      for (i = 0; i < op->count; i++) {
+        code = op->code[i];
+        if (code < 64 && (profile->rest_min & BIT_ULL(code)))
+          value = input_abs_get_min(dev, code);
+        else
+          value = (input_abs_get_min(dev, code) +
+                   input_abs_get_max(dev, code) + 1) / 2;
+        input_report_abs(dev, code, value);
+      }
+      break;
     }
-    break;
   }
 
-  return 0;
+  input_sync(dev);
 }
 
+static enum hrtimer_restart mi_stall_timer_fn(struct hrtimer *timer)
+{
+  struct miff_device *miff = container_of(timer, struct miff_device, stall_timer);
+
+  WRITE_ONCE(miff->stalled, true);
+  schedule_work(&miff->stall_worker);
+  return HRTIMER_NORESTART;
+}
+
+static void mi_stall_worker(struct work_struct *work)
+{
+  struct miff_device *miff = container_of(work, struct miff_device, stall_worker);
+  unsigned long flags;
+
+  if (READ_ONCE(miff->stalled)) {
+    miff->stalls++;
+    hid_dbg(miff->hdev, "no report for %lld ms, releasing inputs\n",
+            ktime_ms_delta(ktime_get(), miff->last_report));
+    spin_lock_irqsave(&miff->input_lock, flags);
+    mi_release_inputs(miff);
+    spin_unlock_irqrestore(&miff->input_lock, flags);
+  } else {
+    hid_dbg(miff->hdev, "link recovered\n");
+  }
+
+  sysfs_notify(&miff->hdev->dev.kobj, NULL, "link_stalled");
+}
+
+/*
+ * Track the effective report interval and re-arm the stall watchdog at
+ * stall_factor times the requested interval, or the measured one when
+ * nothing was requested.
+ */
+static void mi_watchdog_kick(struct miff_device *miff, ktime_t now)
+{
+  unsigned int factor = READ_ONCE(miff->state.stall_factor);
+  s64 delta, expected;
+
+  if (unlikely(READ_ONCE(miff->stalled))) {
+    WRITE_ONCE(miff->stalled, false);
+    schedule_work(&miff->stall_worker);
+  } else if (miff->last_report) {
+    delta = ktime_to_ns(ktime_sub(now, miff->last_report));
+    if (miff->interval_ns)
+      miff->interval_ns += (delta - miff->interval_ns) >> 3;
+    else
+      miff->interval_ns = delta;
+  }
+  miff->last_report = now;
+
+  if (!factor)
+    return;
+
+  expected = miff->state.interval_ms ?
+             (s64)miff->state.interval_ms * NSEC_PER_MSEC : miff->interval_ns;
+  if (expected)
+    hrtimer_start(&miff->stall_timer, ns_to_ktime(expected * factor),
+                  HRTIMER_MODE_REL);
+}
+
+static int mi_raw_event(struct hid_device *hdev, struct hid_report *report,
+                        u8 *data, int size)
+{
+  struct miff_device *miff = hid_get_drvdata(hdev);
+  unsigned long flags;
+  ktime_t now;
+
+  if (!miff->input || READ_ONCE(miff->suspended) ||
+      report->id != miff->profile->report_id)
+    return 0;
+  if (size < miff->plan_size)
+    return 0;
+
+  now = ktime_get();
+  if (unlikely(!miff->first_input)) {
+    miff->first_input = now;
+    hid_dbg(hdev, "first input %lld us after probe\n",
+            ktime_us_delta(miff->first_input, miff->probed));
+  }
+
+  spin_lock_irqsave(&miff->input_lock, flags);
+  /* hid_hw_close() doesn't stop every transport from streaming */
+  if (miff->input && READ_ONCE(miff->input->users)) {
+    mi_watchdog_kick(miff, now);
+    mi_decode(miff, data + 1);
+  }
+  spin_unlock_irqrestore(&miff->input_lock, flags);
+  return 0;
+}
 
 static inline void miff_init_work(struct miff_device *miff, void (*worker)(struct work_struct *))
 {
-  if (!miff->worker_initialized)
+  if (!miff->worker_initialized) {
     INIT_WORK(&miff->state_worker, worker);
+    INIT_DELAYED_WORK(&miff->idle_worker, miff_idle_worker);
+    INIT_WORK(&miff->stall_worker, mi_stall_worker);
+    hrtimer_setup(&miff->stall_timer, mi_stall_timer_fn, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+  }
 
   miff->worker_initialized = 1;
 }
 
 static inline void miff_cancel_work_sync(struct miff_device *miff)
 {
-  if (miff->worker_initialized)
+  if (miff->worker_initialized) {
+    hrtimer_cancel(&miff->stall_timer);
+    cancel_work_sync(&miff->stall_worker);
+    cancel_delayed_work_sync(&miff->idle_worker);
     cancel_work_sync(&miff->state_worker);
+  }
+}
+
+/*
+ * Stop every effect ff-memless is playing so it drops its timer. The
+ * playing bits are kept for miff_ff_resume(), minus effects that had
+ * already run their course.
+ */
+static void miff_ff_stop(struct miff_device *miff)
+{
+  struct input_dev *dev = miff->input;
+  unsigned long flags;
+  unsigned int id;
+
+  if (!dev || !dev->ff)
+    return;
+
+  spin_lock_irqsave(&dev->event_lock, flags);
+  for_each_set_bit(id, miff->ff_playing, MI_FF_EFFECTS) {
+    if (miff->ff_until[id] && time_after(jiffies, miff->ff_until[id]))
+      __clear_bit(id, miff->ff_playing);
+    else
+      dev->ff->playback(dev, id, 0);
+  }
+  spin_unlock_irqrestore(&dev->event_lock, flags);
+}
+
+static void miff_ff_resume(struct miff_device *miff)
+{
+  struct input_dev *dev = miff->input;
+  unsigned long flags;
+  unsigned int id;
+
+  if (!dev || !dev->ff)
+    return;
+
+  spin_lock_irqsave(&dev->event_lock, flags);
+  for_each_set_bit(id, miff->ff_playing, MI_FF_EFFECTS) {
+    if (!dev->ff->effect_owners[id]) {
+      __clear_bit(id, miff->ff_playing);
+      continue;
+    }
+    miff_track(miff, dev, id, miff->ff_count[id]);
+    dev->ff->playback(dev, id, miff->ff_count[id]);
+  }
+  spin_unlock_irqrestore(&dev->event_lock, flags);
+}
+
+/*
+ * Stop everything that would talk to the pad or wake the host: pending
+ * rumble is dropped and the motors zeroed, reports are ignored until
+ * mi_restore(). send is false when the transport is already going away
+ * and a rumble-off report would only wait on a dead link.
+ */
+static void mi_quiesce(struct miff_device *miff, bool send)
+{
+  if (miff->suspended)
+    return;
+
+  WRITE_ONCE(miff->suspended, true);
+  miff_ff_stop(miff);
+  miff_cancel_work_sync(miff);
+  miff->left = miff->right = 0;
+  if (send)
+    miff_send(miff, 0, 0);
+}
+
+/*
+ * Bring back what was configured: the report interval, a clean watchdog
+ * and whatever effects were playing when we went down.
+ */
+static void mi_restore(struct miff_device *miff)
+{
+  miff->last_report = 0;
+  WRITE_ONCE(miff->stalled, false);
+  WRITE_ONCE(miff->suspended, false);
+  if (miff->state.interval_ms)
+    miff_send(miff, miff->left, miff->right);
+  miff_ff_resume(miff);
+}
+
+/*
+ * Bluetooth transports never call the hid_driver PM hooks, so follow
+ * system sleep directly as well.
+ */
+static int mi_pm_notify(struct notifier_block *nb, unsigned long action,
+                        void *data)
+{
+  struct miff_device *miff = container_of(nb, struct miff_device, pm_notifier);
+
+  switch (action) {
+  case PM_HIBERNATION_PREPARE:
+  case PM_SUSPEND_PREPARE:
+    mi_quiesce(miff, true);
+    break;
+  case PM_POST_HIBERNATION:
+  case PM_POST_SUSPEND:
+    mi_restore(miff);
+    break;
+  }
+
+  return NOTIFY_DONE;
+}
+
+/*
+ * Pads are keyed by Bluetooth address. A dropped pad parks its state here
+ * for reconnect_cache_secs, holding on to its slot until then.
+ */
+struct mi_cache_entry {
+  char uniq[64];
+  struct mi_pad_state state;
+  unsigned long expires;
+  ktime_t dropped;
+};
+
+static struct mi_cache_entry mi_cache[MI_MAX_PADS];
+static DECLARE_BITMAP(mi_slots, MI_MAX_PADS);
+static DEFINE_MUTEX(mi_cache_lock);
+
+static void mi_cache_expire(void)
+{
+  int i;
+
+  for (i = 0; i < MI_MAX_PADS; i++) {
+    struct mi_cache_entry *entry = &mi_cache[i];
+
+    if (entry->uniq[0] && time_after(jiffies, entry->expires)) {
+      clear_bit(entry->state.slot, mi_slots);
+      entry->uniq[0] = '\0';
+    }
+  }
+}
+
+static struct mi_cache_entry *mi_cache_find(const char *uniq)
+{
+  int i;
+
+  for (i = 0; i < MI_MAX_PADS; i++)
+    if (mi_cache[i].uniq[0] && !strcmp(mi_cache[i].uniq, uniq))
+      return &mi_cache[i];
+  return NULL;
 }
 
+static struct mi_cache_entry *mi_cache_oldest(void)
+{
+  struct mi_cache_entry *oldest = NULL;
+  int i;
+
+  for (i = 0; i < MI_MAX_PADS; i++)
+    if (mi_cache[i].uniq[0] &&
+        (!oldest || time_before(mi_cache[i].expires, oldest->expires)))
+      oldest = &mi_cache[i];
+  return oldest;
+}
+
+static void mi_cache_restore(struct miff_device *miff)
+{
+  const char *uniq = miff->hdev->uniq;
+  struct mi_cache_entry *entry;
+  int slot;
+
+  mutex_lock(&mi_cache_lock);
+  mi_cache_expire();
+
+  entry = uniq[0] ? mi_cache_find(uniq) : NULL;
+  if (entry) {
+    miff->state = entry->state;
+    miff->state.reconnects++;
+    miff->dropped = entry->dropped;
+    entry->uniq[0] = '\0';
+    mutex_unlock(&mi_cache_lock);
+    hid_info(miff->hdev, "reconnected to slot %d after %lld ms\n",
+             miff->state.slot, ktime_ms_delta(miff->probed, miff->dropped));
+    return;
+  }
+
+  slot = find_first_zero_bit(mi_slots, MI_MAX_PADS);
+  if (slot < MI_MAX_PADS) {
+    set_bit(slot, mi_slots);
+  } else {
+    /* All slots parked, hand over the one closest to expiry */
+    entry = mi_cache_oldest();
+    if (entry) {
+      slot = entry->state.slot;
+      entry->uniq[0] = '\0';
+    } else {
+      slot = -1;
+    }
+  }
+  miff->state.slot = slot;
+  mutex_unlock(&mi_cache_lock);
+}
+
+static void mi_cache_store(struct miff_device *miff)
+{
+  const char *uniq = miff->hdev->uniq;
+  struct mi_cache_entry *entry = NULL;
+  int i;
+
+  if (miff->state.slot < 0)
+    return;
+
+  mutex_lock(&mi_cache_lock);
+  mi_cache_expire();
+
+  if (uniq[0] && reconnect_cache_secs)
+    for (i = 0; i < MI_MAX_PADS && !entry; i++)
+      if (!mi_cache[i].uniq[0])
+        entry = &mi_cache[i];
+
+  if (entry) {
+    strscpy(entry->uniq, uniq, sizeof(entry->uniq));
+    entry->state = miff->state;
+    entry->dropped = ktime_get();
+    entry->expires = jiffies + reconnect_cache_secs * HZ;
+  } else {
+    clear_bit(miff->state.slot, mi_slots);
+  }
+  mutex_unlock(&mi_cache_lock);
+}
+
+/*
+ * Rumble groups: one write to the driver's group_rumble attribute drives
+ * every pad bound to that group, sent back to back from a single worker
+ * so the pads fire as close together as the transport allows.
+ *
+ * mi_group_lock covers membership and the pending requests and is only
+ * ever held briefly. mi_group_burst_lock is held while a burst is on the
+ * wire, so unlinking a pad waits for any send that may still target it.
+ */
+struct mi_group_req {
+  int left, right;
+  unsigned long stop_at;  /* jiffies, 0 plays until told otherwise */
+};
+
+static LIST_HEAD(mi_group_pads);
+static unsigned int mi_group_members;
+static struct mi_group_req mi_group_reqs[MI_MAX_GROUPS + 1];
+static DECLARE_BITMAP(mi_group_pending, MI_MAX_GROUPS + 1);
+static DEFINE_MUTEX(mi_group_lock);
+static DEFINE_MUTEX(mi_group_burst_lock);
+
+static void mi_group_worker_fn(struct work_struct *work)
+{
+  struct {
+    struct miff_device *miff;
+    int left, right;
+  } burst[MI_MAX_PADS];
+  struct miff_device *miff;
+  unsigned int i, n = 0;
+  ktime_t start = 0;
+
+  mutex_lock(&mi_group_burst_lock);
+
+  mutex_lock(&mi_group_lock);
+  list_for_each_entry(miff, &mi_group_pads, group_node) {
+    unsigned int group = miff->state.group;
+
+    if (!test_bit(group, mi_group_pending) || READ_ONCE(miff->suspended))
+      continue;
+    burst[n].miff = miff;
+    burst[n].left = mi_group_reqs[group].left;
+    burst[n].right = mi_group_reqs[group].right;
+    n++;
+  }
+  bitmap_zero(mi_group_pending, MI_MAX_GROUPS + 1);
+  mutex_unlock(&mi_group_lock);
+
+  for (i = 0; i < n; i++) {
+    miff = burst[i].miff;
+    miff->left = burst[i].left;
+    miff->right = burst[i].right;
+    miff_send(miff, miff->left, miff->right);
+
+    /* Skew is measured against the first pad of the burst */
+    if (!start)
+      start = ktime_get();
+    miff->group_skew_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  }
+
+  mutex_unlock(&mi_group_burst_lock);
+}
+
+static DECLARE_WORK(mi_group_worker, mi_group_worker_fn);
+static struct delayed_work mi_group_stop[MI_MAX_GROUPS];
+
+/* Called with mi_group_lock held */
+static void mi_group_queue(unsigned int group, int left, int right,
+                           unsigned int length_ms)
+{
+  struct mi_group_req *req = &mi_group_reqs[group];
+
+  req->left = left;
+  req->right = right;
+  req->stop_at = 0;
+  if (length_ms) {
+    req->stop_at = jiffies + msecs_to_jiffies(length_ms);
+    mod_delayed_work(system_wq, &mi_group_stop[group - 1],
+                     msecs_to_jiffies(length_ms));
+  }
+
+  set_bit(group, mi_group_pending);
+  queue_work(system_highpri_wq, &mi_group_worker);
+}
+
+static void mi_group_stop_fn(struct work_struct *work)
+{
+  unsigned int group = to_delayed_work(work) - mi_group_stop + 1;
+  struct mi_group_req *req = &mi_group_reqs[group];
+
+  mutex_lock(&mi_group_lock);
+  /* Unless a newer request for the group has taken over */
+  if (req->stop_at && !time_before(jiffies, req->stop_at))
+    mi_group_queue(group, 0, 0, 0);
+  mutex_unlock(&mi_group_lock);
+}
+
+static int mi_group_set(struct miff_device *miff, unsigned int group)
+{
+  bool member;
+
+  mutex_lock(&mi_group_lock);
+  member = !list_empty(&miff->group_node);
+  if (group && !member && mi_group_members == MI_MAX_PADS) {
+    mutex_unlock(&mi_group_lock);
+    return -ENOSPC;
+  }
+
+  if (member) {
+    list_del_init(&miff->group_node);
+    mi_group_members--;
+  }
+  miff->state.group = group;
+  miff->group_skew_ns = 0;
+  if (group) {
+    list_add_tail(&miff->group_node, &mi_group_pads);
+    mi_group_members++;
+  }
+  mutex_unlock(&mi_group_lock);
+  return 0;
+}
+
+/* Unbind on remove, keeping state.group for the reconnect cache */
+static void mi_group_unlink(struct miff_device *miff)
+{
+  mutex_lock(&mi_group_lock);
+  if (!list_empty(&miff->group_node)) {
+    list_del_init(&miff->group_node);
+    mi_group_members--;
+  }
+  mutex_unlock(&mi_group_lock);
+
+  /* Wait out a burst that may have picked the pad up already */
+  mutex_lock(&mi_group_burst_lock);
+  mutex_unlock(&mi_group_burst_lock);
+}
+
+/*
+ * "<group> <weak> <strong> [length_ms]", magnitudes as in struct
+ * ff_rumble_effect. Without a length the group keeps rumbling until a
+ * write of "<group> 0 0" stops it.
+ */
+static ssize_t group_rumble_store(struct device_driver *drv, const char *buf,
+                                  size_t count)
+{
+  unsigned int group, weak, strong, length_ms = 0;
+
+  if (sscanf(buf, "%u %u %u %u", &group, &weak, &strong, &length_ms) < 3)
+    return -EINVAL;
+  if (!group || group > MI_MAX_GROUPS || weak > 0xffff || strong > 0xffff)
+    return -EINVAL;
+
+  mutex_lock(&mi_group_lock);
+  mi_group_queue(group, weak / 256, strong / 256, length_ms);
+  mutex_unlock(&mi_group_lock);
+
+  return count;
+}
+static DRIVER_ATTR_WO(group_rumble);
+
+static ssize_t mi_slot_show(struct device *dev, struct device_attribute *attr,
+                            char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%d\n", miff->state.slot);
+}
+
+static ssize_t mi_reconnects_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%u\n", miff->state.reconnects);
+}
+
+/* Drop to re-probe, 0 on a first connect */
+static ssize_t mi_reconnect_gap_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  if (!miff->dropped)
+    return sysfs_emit(buf, "0\n");
+  return sysfs_emit(buf, "%lld\n", ktime_us_delta(miff->probed, miff->dropped));
+}
+
+/* Probe to first decoded input report, 0 until it arrives */
+static ssize_t mi_first_input_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  if (!miff->first_input)
+    return sysfs_emit(buf, "0\n");
+  return sysfs_emit(buf, "%lld\n", ktime_us_delta(miff->first_input, miff->probed));
+}
+
+static ssize_t mi_rumble_group_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%u\n", miff->state.group);
+}
+
+static ssize_t mi_rumble_group_store(struct device *dev,
+                                     struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+  unsigned int group;
+  int error;
+
+  error = kstrtouint(buf, 0, &group);
+  if (error)
+    return error;
+  if (group > MI_MAX_GROUPS)
+    return -EINVAL;
+
+  error = mi_group_set(miff, group);
+  return error ? error : count;
+}
+
+/* Offset of this pad's rumble from the first pad of the last group burst */
+static ssize_t mi_rumble_skew_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%lld\n", miff->group_skew_ns);
+}
+
+/* Requested report interval in ms, 0 leaves it to the firmware */
+static ssize_t mi_report_interval_show(struct device *dev,
+                                       struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%u\n", miff->state.interval_ms);
+}
+
+static ssize_t mi_report_interval_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+  unsigned int ms;
+  int error;
+
+  error = kstrtouint(buf, 0, &ms);
+  if (error)
+    return error;
+  if (ms > 0xff)
+    return -EINVAL;
+  if (!miff->profile->ff.interval || !miff->report)
+    return -EOPNOTSUPP;
+
+  miff->state.interval_ms = ms;
+  miff_send(miff, miff->left, miff->right);
+  return count;
+}
+
+static ssize_t mi_measured_interval_show(struct device *dev,
+                                         struct device_attribute *attr,
+                                         char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%lld\n", div_s64(READ_ONCE(miff->interval_ns), NSEC_PER_USEC));
+}
+
+static ssize_t mi_stall_factor_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%u\n", miff->state.stall_factor);
+}
+
+static ssize_t mi_stall_factor_store(struct device *dev,
+                                     struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+  unsigned int factor;
+  int error;
+
+  error = kstrtouint(buf, 0, &factor);
+  if (error)
+    return error;
+
+  WRITE_ONCE(miff->state.stall_factor, factor);
+  if (!factor)
+    hrtimer_cancel(&miff->stall_timer);
+  return count;
+}
+
+static ssize_t mi_link_stalled_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%d\n", READ_ONCE(miff->stalled));
+}
+
+static ssize_t mi_stalls_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+  struct miff_device *miff = hid_get_drvdata(to_hid_device(dev));
+
+  return sysfs_emit(buf, "%u\n", miff->stalls);
+}
+
+static DEVICE_ATTR(slot, 0444, mi_slot_show, NULL);
+static DEVICE_ATTR(reconnects, 0444, mi_reconnects_show, NULL);
+static DEVICE_ATTR(reconnect_gap_us, 0444, mi_reconnect_gap_show, NULL);
+static DEVICE_ATTR(first_input_us, 0444, mi_first_input_show, NULL);
+static DEVICE_ATTR(rumble_group, 0644, mi_rumble_group_show, mi_rumble_group_store);
+static DEVICE_ATTR(rumble_skew_ns, 0444, mi_rumble_skew_show, NULL);
+static DEVICE_ATTR(report_interval_ms, 0644, mi_report_interval_show, mi_report_interval_store);
+static DEVICE_ATTR(measured_interval_us, 0444, mi_measured_interval_show, NULL);
+static DEVICE_ATTR(stall_factor, 0644, mi_stall_factor_show, mi_stall_factor_store);
+static DEVICE_ATTR(link_stalled, 0444, mi_link_stalled_show, NULL);
+static DEVICE_ATTR(stalls, 0444, mi_stalls_show, NULL);
+
+static struct attribute *mi_attrs[] = {
+  &dev_attr_slot.attr,
+  &dev_attr_reconnects.attr,
+  &dev_attr_reconnect_gap_us.attr,
+  &dev_attr_first_input_us.attr,
+  &dev_attr_rumble_group.attr,
+  &dev_attr_rumble_skew_ns.attr,
+  &dev_attr_report_interval_ms.attr,
+  &dev_attr_measured_interval_us.attr,
+  &dev_attr_stall_factor.attr,
+  &dev_attr_link_stalled.attr,
+  &dev_attr_stalls.attr,
+  NULL
+};
+
+static const struct attribute_group mi_attr_group = {
+  .attrs = mi_attrs,
+};
+
+static const struct attribute_group *mi_attr_groups[] = {
+  &mi_attr_group,
+  NULL
+};
+
 static int mi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
   int error;
   struct miff_device *miff;
+  const struct mi_profile *profile = (const struct mi_profile *)id->driver_data;
 
-  strcpy(hdev->name, "Microsoft X-Box 360 pad");
-  hdev->vendor = 0x045e;
-  hdev->product = 0x028e;
-  hdev->version = 0x0110;
-  hdev->bus = 0x0003;
+  strscpy(hdev->name, profile->name, sizeof(hdev->name));
+  hdev->vendor = profile->vendor;
+  hdev->product = profile->product;
+  hdev->version = profile->version;
+  hdev->bus = profile->bus;
 
   dev_dbg(&hdev->dev, "Xiaomi HID hardware probe...\n");
 
@@ -391,6 +1577,13 @@ static int mi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 
   hid_set_drvdata(hdev, miff);
   miff->hdev = hdev;
+  miff->profile = profile;
+  miff->dpad_keys = dpad_keys;
+  miff->probed = ktime_get();
+  mutex_init(&miff->ff_lock);
+  spin_lock_init(&miff->input_lock);
+  miff->state.stall_factor = stall_factor;
+  INIT_LIST_HEAD(&miff->group_node);
 
   error = hid_parse(hdev);
   if (error) {
@@ -398,27 +1591,78 @@ static int mi_probe(struct hid_device *hdev, const struct hid_device_id *id)
     return error;
   }
 
-  error = hid_hw_start(hdev, HID_CONNECT_DEFAULT & ~HID_CONNECT_FF);
+  /* Reports are decoded in mi_raw_event, keep hid-input out of the way */
+  error = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
   if (error) {
     hid_err(hdev, "hw start failed\n");
     return error;
   }
 
   miff_init_work(miff, miff_state_worker);
-  mi_init_ff(miff);
+
+  error = mi_init_input(miff);
+  if (error) {
+    hid_err(hdev, "input init failed\n");
+    goto err_stop;
+  }
+
+  mi_cache_restore(miff);
+  if (mi_group_set(miff, miff->state.group))
+    miff->state.group = 0;
+  if (miff->state.interval_ms)
+    miff_send(miff, 0, 0);
+
+  miff->pm_notifier.notifier_call = mi_pm_notify;
+  register_pm_notifier(&miff->pm_notifier);
 
   return 0;
+
+err_stop:
+  miff_cancel_work_sync(miff);
+  hid_hw_stop(hdev);
+  return error;
 }
 
 static void mi_remove(struct hid_device *hdev)
 {
   struct miff_device *miff = hid_get_drvdata(hdev);
-  miff_cancel_work_sync(miff);
+  unregister_pm_notifier(&miff->pm_notifier);
+  mi_cache_store(miff);
+  mi_group_unlink(miff);
+  mi_quiesce(miff, false);
+  mi_remove_input(miff);
   hid_hw_stop(hdev);
+  /* A report racing the quiesce may have re-armed the watchdog */
+  miff_cancel_work_sync(miff);
 }
 
+#ifdef CONFIG_PM
+static int mi_suspend(struct hid_device *hdev, pm_message_t message)
+{
+  mi_quiesce(hid_get_drvdata(hdev), true);
+  return 0;
+}
+
+static int mi_resume(struct hid_device *hdev)
+{
+  mi_restore(hid_get_drvdata(hdev));
+  return 0;
+}
+
+static int mi_reset_resume(struct hid_device *hdev)
+{
+  struct miff_device *miff = hid_get_drvdata(hdev);
+
+  /* The pad lost whatever it was told before the reset */
+  miff_send(miff, 0, 0);
+  mi_restore(miff);
+  return 0;
+}
+#endif
+
 static const struct hid_device_id mi_devices[] = {
-  { HID_BLUETOOTH_DEVICE(0x2717, 0x3144) },
+  { HID_BLUETOOTH_DEVICE(0x2717, 0x3144),
+    .driver_data = (kernel_ulong_t)&mi_gamepad_profile },
   { }
 };
 MODULE_DEVICE_TABLE(hid, mi_devices);
@@ -426,14 +1670,52 @@ MODULE_DEVICE_TABLE(hid, mi_devices);
 static struct hid_driver mi_driver = {
   .name         = "migamepad",
   .id_table     = mi_devices,
-  //.input_mapping= mi_mapping,
-  .input_mapped = mi_mapped,
   .probe        = mi_probe,
-  .event        = mi_event,
+  .raw_event    = mi_raw_event,
   .remove       = mi_remove,
-  .report_fixup = mi_report_fixup
+#ifdef CONFIG_PM
+  .suspend      = mi_suspend,
+  .resume       = mi_resume,
+  .reset_resume = mi_reset_resume,
+#endif
+  .report_fixup = mi_report_fixup,
+  /* Created by the driver core before the bind uevent */
+  .driver.dev_groups = mi_attr_groups,
 };
-module_hid_driver(mi_driver);
+
+static int __init mi_init(void)
+{
+  int error, i;
+
+  for (i = 0; i < MI_MAX_GROUPS; i++)
+    INIT_DELAYED_WORK(&mi_group_stop[i], mi_group_stop_fn);
+
+  error = hid_register_driver(&mi_driver);
+  if (error)
+    return error;
+
+  error = driver_create_file(&mi_driver.driver, &driver_attr_group_rumble);
+  if (error) {
+    hid_unregister_driver(&mi_driver);
+    return error;
+  }
+
+  return 0;
+}
+
+static void __exit mi_exit(void)
+{
+  int i;
+
+  driver_remove_file(&mi_driver.driver, &driver_attr_group_rumble);
+  hid_unregister_driver(&mi_driver);
+  for (i = 0; i < MI_MAX_GROUPS; i++)
+    cancel_delayed_work_sync(&mi_group_stop[i]);
+  cancel_work_sync(&mi_group_worker);
+}
+
+module_init(mi_init);
+module_exit(mi_exit);
 
 MODULE_AUTHOR("Maxim Lapunin");
 MODULE_DESCRIPTION("Force feedback support for Xiaomi Gamepad");